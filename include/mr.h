@@ -26,6 +26,26 @@
 #define STORAGE_INITIAL_SIZE 64
 #define STORAGE_INCR_RATIO 1.25
 
+// Number of times a failed map task is executed again before the job
+// is aborted.
+#define TASK_MAX_RETRIES 3
+
+// Value returned by the map function to report that it failed to
+// process its input. The output emitted during that attempt is
+// discarded and the task is scheduled again.
+#define TASK_FAILED ((void *)-1)
+
+// A map task is a straggler when its progress is below
+// SPECULATIVE_SLOWNESS times the median progress of the tasks and it
+// is running for at least SPECULATIVE_MIN_ELAPSED_MS. A backup of it
+// is then executed on an idle thread. The progress of the tasks is
+// checked every SPECULATIVE_INTERVAL_MS. The attempt which loses is
+// only stopped between two input_splits and the job waits for it, so
+// a single slow input_split still delays the end of the job.
+#define SPECULATIVE_SLOWNESS 0.5
+#define SPECULATIVE_MIN_ELAPSED_MS 200
+#define SPECULATIVE_INTERVAL_MS 50
+
 #ifdef DEBUG
 #define PRINT_DEBUG 1
 #else
@@ -76,8 +96,12 @@ struct operations {
 	struct input_split *(*inputify) (void *);
 
 	// Takes a document input_splits which are going to be emit by
-	// key/value. A struct input_split * is passed to it but this
-	// function is directly used by pthread_create.
+	// key/value. A struct input_split * is passed to it, one split
+	// at time: its 'next' is always NULL. The function is executed
+	// in the thread of a map task. Since a task can be executed
+	// again or concurrently by a backup with the same input_splits,
+	// the function must not modify them. Returns NULL on success or
+	// TASK_FAILED.
 	void *(*map) (void *);
 
 	// Returns pointer of input data which will be passed to the
@@ -86,8 +110,22 @@ struct operations {
 	unsigned int (*reduce) (struct hentry *, unsigned int, void **);
 
 	// Takes result from the 'reduce' operation to output it
-	// within different format.
+	// within different format. In a pipeline, it is only called
+	// for the last stage.
 	int (*outputify) (void *, unsigned int);
+
+	// Converts the result of the 'reduce' operation to input_splits
+	// passed to the map of the next stage of a pipeline. The values
+	// of the splits can directly reference the result, they are not
+	// released by the framework. Only needed for the intermediate
+	// stages of a pipeline.
+	struct input_split *(*forward) (void *, unsigned int);
+
+	// Releases the result of the 'reduce' operation of an
+	// intermediate stage of a pipeline. It is called once the next
+	// stage is done with it, whether that stage has succeeded or
+	// not. Can be NULL when there is nothing to release.
+	void (*release) (void *, unsigned int);
 };
 
 // Distributing the linked-list of inputs to the threads. The design
@@ -97,22 +135,76 @@ struct operations {
 // going to execute the map function.
 void distribute(struct input_split *, struct input_split *[], unsigned int);
 
+// Releases the nodes and values of a linked-list of input_split.
+void input_split_deallocate(struct input_split *);
+
 // The emit is storing key/value in the in-memory storage, if the key
 // already exists so the value is appenned. The storage uses a default
 // size STORAGE_INITIAL_SIZE, and increases its size if necessary by
 // STORAGE_INCR_RATIO. Considering to adjust this for performance.
-// The emit operation is thread-safe.
+// The key and the value are copied so the caller keeps ownership of
+// them. When called from a map task the key/value is first recorded
+// in the task output and only reaches the storage once the task has
+// succeeded. The emit operation is thread-safe.
 int emit(char *, void *, unsigned int);
 
+// Options to tune the way a job is scheduled.
+struct job_options {
+	// Directory where the output of each completed map task is
+	// committed in a run file. A job restarted with the same
+	// input, threads and directory resumes from the tasks already
+	// committed instead of executing them again. The run files
+	// are removed once the job has succeeded. NULL to disable.
+	// A rundir must not be shared between jobs with different
+	// inputs unless they use different 'jobid'.
+	char *rundir;
+
+	// Identifier of the job recorded in its run files, a run file
+	// committed by a job with another identifier is ignored. The
+	// run files of jobs without identifier all match.
+	char *jobid;
+
+	// Number of times a failed map task is executed again.
+	unsigned int retries;
+
+	// Whether a backup of the straggler tasks is executed, the
+	// output of the first attempt to finish is kept.
+	int speculative;
+
+	// Path of the file where the trace of the job is written in
+	// the Chrome trace JSON format. When NULL, the path is read
+	// from the MR_TRACE environment variable, the job is not
+	// traced if it is not set.
+	char *trace;
+};
+
 // The function is sheduling the operations:
 //
 // 1. Split the document
-// 2. Distribute the chunks of documents accros the map functions
-// 3. Call the reducer
-// 4. Execute the output job iwth result of the reducer
-// 5. Release resources
+// 2. Distribute the chunks of documents accros the map tasks
+// 3. Execute the map tasks, retrying the ones which have failed
+// 4. Call the reducer
+// 5. Execute the output job iwth result of the reducer
+// 6. Release resources
+//
+// The default options are used when 'opts' is NULL.
+int operate_with(struct operations *op, void *input, unsigned int numthreads,
+		 struct job_options *opts);
+
+// Same as operate_with, using the default options: no checkpointing,
+// TASK_MAX_RETRIES retries and speculative execution. With the
+// speculative execution the map of a task can be executed twice,
+// concurrently, only the output of one execution is kept.
 int operate(struct operations *op, void *input, unsigned int numthreads);
 
+// Chains the jobs of the 'stages'. The first stage is reading the
+// input with its 'inputify' operation, then the result of the reduce
+// of each stage is passed in memory to the map of the next one with
+// its 'forward' operation, without being outputted and parsed again.
+// The result of a stage is kept until the next stage has reduced.
+int pipeline(struct operations *stages[], unsigned int nstages, void *input,
+	     unsigned int numthreads, struct job_options *opts);
+
 // We provide for free function to parse text based documents
 struct file_input_format_params {
 	char *filename;
@@ -0,0 +1,524 @@
+/*
+ * Copyright (C) 2017 Sahid Orentino Ferdjaoui
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MR_TYPED_H_
+#define _MR_TYPED_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "include/mr.h"
+#include "include/trace.h"
+
+// Typed front end of the framework. When the key and the value of a
+// job have fixed types, MR_TYPED_JOB generates a job specialised for
+// them: the map function emits directly in a per-thread hash table
+// where values of a same key are combined in place, the tables are
+// then merged and sorted by key. Everything is generated as static
+// inline functions, the sort included, so the compiler can inline the
+// hashing, the comparisons and the combine function instead of going
+// through 'void *' values and function pointers. The combine function has to
+// be associative since it is also used to merge the tables, it is
+// the reduce of the job.
+//
+//   static inline uint64_t add(uint64_t a, uint64_t b) { return a + b; }
+//   MR_TYPED_JOB(wc, str, char *, uint64_t, add)
+//
+// generates 'struct wc_table', 'struct wc_entry' (key, value),
+// 'wc_emit(struct wc_table *, char *, uint64_t)' to be called by the
+// map function and 'wc_operate(struct wc_operations *, void *,
+// unsigned int)' to run the job. The generic 'operate' remains the
+// way to go for other jobs. The jobs are traced like the generic ones
+// when the MR_TRACE environment variable is set, emit excepted to
+// keep it inlined.
+
+#define TYPED_TABLE_INITIAL_SIZE 1024
+
+// Ranges smaller than this are sorted by insertion.
+#define TYPED_SORT_THRESHOLD 16
+
+// Key traits, MR_TYPED_JOB is expecting for a key trait 'k' the
+// functions mr_k_hash, mr_k_eq, mr_k_cmp, mr_k_dup and mr_k_free.
+
+// 'str', keys are NUL terminated strings copied in the table.
+static inline uint64_t mr_str_hash(const char *key)
+{
+	// FNV-1a
+	uint64_t h = 14695981039346656037ULL;
+	while (*key) {
+		h ^= (unsigned char)*key++;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+static inline int mr_str_eq(const char *k1, const char *k2)
+{
+	return strcmp(k1, k2) == 0;
+}
+
+static inline int mr_str_cmp(const char *k1, const char *k2)
+{
+	return strcmp(k1, k2);
+}
+
+static inline int mr_str_dup(char *key, char **dst)
+{
+	*dst = strdup(key);
+	return *dst ? 0 : -1;
+}
+
+static inline void mr_str_free(char *key)
+{
+	free(key);
+}
+
+// 'u64', keys are unsigned 64 bits integers.
+static inline uint64_t mr_u64_hash(uint64_t key)
+{
+	// Finalizer of splitmix64
+	key ^= key >> 30;
+	key *= 0xbf58476d1ce4e5b9ULL;
+	key ^= key >> 27;
+	key *= 0x94d049bb133111ebULL;
+	key ^= key >> 31;
+	return key;
+}
+
+static inline int mr_u64_eq(uint64_t k1, uint64_t k2)
+{
+	return k1 == k2;
+}
+
+static inline int mr_u64_cmp(uint64_t k1, uint64_t k2)
+{
+	return (k1 > k2) - (k1 < k2);
+}
+
+static inline int mr_u64_dup(uint64_t key, uint64_t *dst)
+{
+	*dst = key;
+	return 0;
+}
+
+static inline void mr_u64_free(uint64_t key)
+{
+}
+
+// Generates the job 'name' for keys of type 'ktype' handled by the
+// key trait 'ktrait' and values of type 'vtype' combined with the
+// function 'combine' (vtype combine(vtype, vtype)).
+#define MR_TYPED_JOB(name, ktrait, ktype, vtype, combine)		\
+									\
+struct name##_entry {							\
+	ktype key;							\
+	vtype value;							\
+};									\
+									\
+/* Open addressing hash table with linear probing, 'size' is always	\
+ * a power of two. */							\
+struct name##_table {							\
+	struct name##_entry *entries;					\
+	unsigned char *used;						\
+	size_t size;							\
+	size_t count;							\
+};									\
+									\
+struct name##_operations {						\
+	/* Split input documents */					\
+	struct input_split *(*inputify) (void *);			\
+									\
+	/* Emits with name##_emit the key/value of the input_splits,	\
+	 * which must not be modified. Returns 0, any other value is	\
+	 * an error. */							\
+	int (*map) (struct input_split *, struct name##_table *);	\
+									\
+	/* Receives the entries sorted by key, the array is released	\
+	 * by the framework. */						\
+	int (*outputify) (struct name##_entry *, size_t);		\
+};									\
+									\
+static inline int name##_table_init(struct name##_table *t, size_t size) \
+{									\
+	struct name##_entry *entries = NULL;				\
+	unsigned char *used = NULL;					\
+									\
+	/* The table is only updated on success, it can then be	\
+	 * released whatever happened. */				\
+	entries = malloc(sizeof(struct name##_entry) * size);		\
+	used = calloc(size, sizeof(unsigned char));			\
+	if (entries == NULL || used == NULL) {				\
+		fprintf(stderr, "Unable to allocate table, %s\n",	\
+			strerror(errno));				\
+		free(entries);						\
+		free(used);						\
+		return -1;						\
+	}								\
+	t->entries = entries;						\
+	t->used = used;							\
+	t->size = size;							\
+	t->count = 0;							\
+	return 0;							\
+}									\
+									\
+static inline void name##_table_deallocate(struct name##_table *t)	\
+{									\
+	for (size_t i = 0; i < t->size; i++) {				\
+		if (t->used[i])						\
+			mr_##ktrait##_free(t->entries[i].key);		\
+	}								\
+	free(t->entries);						\
+	free(t->used);							\
+	t->entries = NULL;						\
+	t->used = NULL;							\
+	t->size = 0;							\
+	t->count = 0;							\
+}									\
+									\
+/* Returns the slot of the key, either used by the key or free. */	\
+static inline size_t name##_table_slot(struct name##_table *t,		\
+				       ktype key)			\
+{									\
+	size_t mask = t->size - 1;					\
+	size_t i = mr_##ktrait##_hash(key) & mask;			\
+	while (t->used[i] && !mr_##ktrait##_eq(t->entries[i].key, key))	\
+		i = (i + 1) & mask;					\
+	return i;							\
+}									\
+									\
+static inline int name##_table_grow(struct name##_table *t)		\
+{									\
+	struct name##_table n;						\
+	if (name##_table_init(&n, t->size * 2) == -1)			\
+		return -1;						\
+	for (size_t i = 0; i < t->size; i++) {				\
+		if (!t->used[i])					\
+			continue;					\
+		size_t s = name##_table_slot(&n, t->entries[i].key);	\
+		n.entries[s] = t->entries[i];				\
+		n.used[s] = 1;						\
+	}								\
+	n.count = t->count;						\
+	free(t->entries);						\
+	free(t->used);							\
+	*t = n;								\
+	return 0;							\
+}									\
+									\
+/* Combines the value with the one already recorded for the key,	\
+ * the key is copied whether it is new. */				\
+static inline int name##_emit(struct name##_table *t, ktype key,	\
+			      vtype value)				\
+{									\
+	size_t s = name##_table_slot(t, key);				\
+	if (t->used[s]) {						\
+		t->entries[s].value = combine(t->entries[s].value, value); \
+		return 0;						\
+	}								\
+	if ((t->count + 1) * 4 > t->size * 3) {			\
+		if (name##_table_grow(t) == -1)				\
+			return -1;					\
+		s = name##_table_slot(t, key);				\
+	}								\
+	if (mr_##ktrait##_dup(key, &t->entries[s].key) == -1)		\
+		return -1;						\
+	t->entries[s].value = value;					\
+	t->used[s] = 1;							\
+	t->count++;							\
+	return 0;							\
+}									\
+									\
+/* Moves the entries of 'src' in 'dst', 'src' is released. */		\
+static inline int name##_table_merge(struct name##_table *dst,		\
+				     struct name##_table *src)		\
+{									\
+	for (size_t i = 0; i < src->size; i++) {			\
+		if (!src->used[i])					\
+			continue;					\
+		ktype key = src->entries[i].key;			\
+		size_t s = name##_table_slot(dst, key);			\
+		if (dst->used[s]) {					\
+			dst->entries[s].value =				\
+			    combine(dst->entries[s].value,		\
+				    src->entries[i].value);		\
+			mr_##ktrait##_free(key);			\
+			src->used[i] = 0;				\
+			continue;					\
+		}							\
+		if ((dst->count + 1) * 4 > dst->size * 3) {		\
+			if (name##_table_grow(dst) == -1)		\
+				return -1;				\
+			s = name##_table_slot(dst, key);		\
+		}							\
+		dst->entries[s] = src->entries[i];			\
+		dst->used[s] = 1;					\
+		dst->count++;						\
+		src->used[i] = 0;					\
+	}								\
+	name##_table_deallocate(src);					\
+	return 0;							\
+}									\
+									\
+static inline int name##_less(struct name##_entry *e1,			\
+			      struct name##_entry *e2)			\
+{									\
+	return mr_##ktrait##_cmp(e1->key, e2->key) < 0;			\
+}									\
+									\
+static inline void name##_swap(struct name##_entry *e1,		\
+			       struct name##_entry *e2)			\
+{									\
+	struct name##_entry tmp = *e1;					\
+	*e1 = *e2;							\
+	*e2 = tmp;							\
+}									\
+									\
+static inline void name##_insertion_sort(struct name##_entry *e,	\
+					 size_t n)			\
+{									\
+	for (size_t i = 1; i < n; i++) {				\
+		struct name##_entry x = e[i];				\
+		size_t j = i;						\
+		while (j > 0 && name##_less(&x, &e[j - 1])) {		\
+			e[j] = e[j - 1];				\
+			j--;						\
+		}							\
+		e[j] = x;						\
+	}								\
+}									\
+									\
+static inline void name##_sift_down(struct name##_entry *e, size_t i,	\
+				    size_t n)				\
+{									\
+	for (;;) {							\
+		size_t c = 2 * i + 1;					\
+		if (c >= n)						\
+			return;						\
+		if (c + 1 < n && name##_less(&e[c], &e[c + 1]))		\
+			c++;						\
+		if (!name##_less(&e[i], &e[c]))				\
+			return;						\
+		name##_swap(&e[i], &e[c]);				\
+		i = c;							\
+	}								\
+}									\
+									\
+static inline void name##_heap_sort(struct name##_entry *e, size_t n)	\
+{									\
+	for (size_t i = n / 2; i-- > 0;)				\
+		name##_sift_down(e, i, n);				\
+	for (size_t i = n; i-- > 1;) {					\
+		name##_swap(&e[0], &e[i]);				\
+		name##_sift_down(e, 0, i);				\
+	}								\
+}									\
+									\
+/* Quicksort with a median of three pivot, recursing on the smallest	\
+ * side, falling back on heapsort when going too deep and finishing	\
+ * the small ranges by insertion. */					\
+static inline void name##_intro_sort(struct name##_entry *e, size_t n,	\
+				     int depth)				\
+{									\
+	while (n > TYPED_SORT_THRESHOLD) {				\
+		if (depth-- == 0) {					\
+			name##_heap_sort(e, n);				\
+			return;						\
+		}							\
+		size_t m = n / 2;					\
+		if (name##_less(&e[m], &e[0]))				\
+			name##_swap(&e[m], &e[0]);			\
+		if (name##_less(&e[n - 1], &e[m])) {			\
+			name##_swap(&e[n - 1], &e[m]);			\
+			if (name##_less(&e[m], &e[0]))			\
+				name##_swap(&e[m], &e[0]);		\
+		}							\
+									\
+		/* e[0] <= pivot <= e[n - 1] bound the scans, the	\
+		 * split is then always in 1..n-1. */			\
+		struct name##_entry pivot = e[m];			\
+		size_t i = 0;						\
+		size_t j = n - 1;					\
+		for (;;) {						\
+			while (name##_less(&e[i], &pivot))		\
+				i++;					\
+			while (name##_less(&pivot, &e[j]))		\
+				j--;					\
+			if (i >= j)					\
+				break;					\
+			name##_swap(&e[i], &e[j]);			\
+			i++;						\
+			j--;						\
+		}							\
+									\
+		if (i < n - i) {					\
+			name##_intro_sort(e, i, depth);			\
+			e += i;						\
+			n -= i;						\
+		} else {						\
+			name##_intro_sort(e + i, n - i, depth);		\
+			n = i;						\
+		}							\
+	}								\
+	name##_insertion_sort(e, n);					\
+}									\
+									\
+/* Sorts the entries by key. */						\
+static inline void name##_sort(struct name##_entry *e, size_t n)	\
+{									\
+	int depth = 0;							\
+	for (size_t k = n; k > 1; k >>= 1)				\
+		depth += 2;						\
+	name##_intro_sort(e, n, depth);					\
+}									\
+									\
+struct name##_task {							\
+	unsigned int id;						\
+	struct name##_operations *op;					\
+	struct input_split *input;					\
+	struct name##_table table;					\
+	int ret;							\
+};									\
+									\
+/* Executes the map function against the input_splits of the task,	\
+ * a failed attempt is discarded and executed again. */			\
+static inline void *name##_task_run(void *arg)				\
+{									\
+	struct name##_task *task = arg;					\
+	for (int attempt = 0; attempt <= TASK_MAX_RETRIES; attempt++) {	\
+		uint64_t start = trace_now();				\
+		TRACE_PROBE(map__start, task->id);			\
+		task->ret = name##_table_init(&task->table,		\
+					      TYPED_TABLE_INITIAL_SIZE); \
+		/* Any other value than 0 is a failure of the map. */	\
+		if (task->ret == 0 &&					\
+		    task->op->map(task->input, &task->table) != 0)	\
+			task->ret = -1;					\
+		TRACE_PROBE(map__done, task->id);			\
+		trace_span(task->ret ? "map (failed)" : "map", start,	\
+			   task->id);					\
+		if (task->ret == 0)					\
+			break;						\
+		name##_table_deallocate(&task->table);			\
+	}								\
+	return NULL;							\
+}									\
+									\
+static inline int name##_operate(struct name##_operations *op,		\
+				 void *params, unsigned int numthreads)	\
+{									\
+	if (numthreads < MIN_THREADS || numthreads > MAX_THREADS) {	\
+		fprintf(stderr,						\
+			"Consider to use a range %d..%d for threads\n",	\
+			MIN_THREADS, MAX_THREADS);			\
+		return -1;						\
+	}								\
+									\
+	struct input_split *buckets[numthreads];			\
+	struct name##_task tasks[numthreads];				\
+	pthread_t mthreads[numthreads];					\
+	int started[numthreads];					\
+	struct name##_entry *sorted = NULL;				\
+	char *trace = getenv(TRACE_ENV);				\
+	uint64_t start = 0;						\
+	size_t count = 0;						\
+	int ret = 0;							\
+									\
+	if (trace)							\
+		trace_start();						\
+									\
+	start = trace_now();						\
+	distribute(op->inputify(params), buckets, numthreads);		\
+	trace_span("inputify", start, 0);				\
+									\
+	/* A task whose thread can't be created is executed by the	\
+	 * caller. */							\
+	for (int i = 0; i < numthreads; i++) {				\
+		memset(&tasks[i], 0, sizeof(struct name##_task));	\
+		tasks[i].id = i;					\
+		tasks[i].op = op;					\
+		tasks[i].input = buckets[i];				\
+		started[i] = pthread_create(&mthreads[i], NULL,		\
+					    name##_task_run,		\
+					    &tasks[i]) == 0;		\
+		if (!started[i])					\
+			name##_task_run(&tasks[i]);			\
+	}								\
+	for (int i = 0; i < numthreads; i++) {				\
+		if (started[i] && pthread_join(mthreads[i], NULL)) {	\
+			fprintf(stderr, "Unable to join thread %i\n", i); \
+			ret = -1;					\
+		}							\
+		if (tasks[i].ret != 0) {				\
+			fprintf(stderr, "Map task %d failed\n", i);	\
+			ret = -1;					\
+		}							\
+	}								\
+	if (ret == -1)							\
+		goto free;						\
+									\
+	/* Reducing, the tables are merged in the first one. */	\
+	for (int i = 1; i < numthreads; i++) {				\
+		start = trace_now();					\
+		TRACE_PROBE(merge__start, i);				\
+		ret = name##_table_merge(&tasks[0].table,		\
+					 &tasks[i].table);		\
+		TRACE_PROBE(merge__done, i);				\
+		trace_span("merge", start, i);				\
+		if (ret == -1)						\
+			goto free;					\
+	}								\
+									\
+	start = trace_now();						\
+	TRACE_PROBE(reduce__start, 0);					\
+									\
+	sorted = malloc(sizeof(struct name##_entry) *			\
+			(tasks[0].table.count + 1));			\
+	if (sorted == NULL) {						\
+		fprintf(stderr, "Unable to allocate output, %s\n",	\
+			strerror(errno));				\
+		ret = -1;						\
+		goto free;						\
+	}								\
+	for (size_t i = 0; i < tasks[0].table.size; i++) {		\
+		if (tasks[0].table.used[i])				\
+			sorted[count++] = tasks[0].table.entries[i];	\
+	}								\
+	name##_sort(sorted, count);					\
+	TRACE_PROBE(reduce__done, 0);					\
+	trace_span("reduce", start, 0);					\
+									\
+	start = trace_now();						\
+	ret = op->outputify(sorted, count);				\
+	trace_span("outputify", start, 0);				\
+	free(sorted);							\
+									\
+ free:									\
+	for (int i = 0; i < numthreads; i++) {				\
+		name##_table_deallocate(&tasks[i].table);		\
+		input_split_deallocate(buckets[i]);			\
+	}								\
+	if (trace && trace_stop(trace) == 0)				\
+		fprintf(stderr, "Trace written in '%s'\n", trace);	\
+	return ret;							\
+}
+
+#endif
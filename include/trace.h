@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2017 Sahid Orentino Ferdjaoui
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+// Number of events kept per thread, the oldest ones are overwritten.
+#define TRACE_BUFFER_SIZE 4096
+
+// Environment variable giving the path of the trace when the job
+// options do not.
+#define TRACE_ENV "MR_TRACE"
+
+// Static markers for perf, bpftrace or systemtap, they are compiled
+// in when <sys/sdt.h> is available and cost a nop otherwise. They are
+// independent of the tracing enabled at runtime.
+//
+//   bpftrace -e 'usdt:./mapred:mr:map__start { @[arg0] = count(); }'
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define TRACE_PROBE(name, arg) DTRACE_PROBE1(mr, name, arg)
+#else
+#define TRACE_PROBE(name, arg)
+#endif
+
+// The tracing records spans and instant events in a ring buffer owned
+// by each thread, recording does not take any lock. The events are
+// exported in the Chrome trace JSON format (chrome://tracing or
+// https://ui.perfetto.dev) when the tracing is stopped.
+extern int trace_enabled;
+
+static inline int trace_on(void)
+{
+	return __atomic_load_n(&trace_enabled, __ATOMIC_RELAXED);
+}
+
+// Starts recording the events.
+void trace_start(void);
+
+// Stops recording and writes the events in 'path'. No other thread
+// is expected to record events at that time.
+int trace_stop(const char *path);
+
+// Returns the timestamp to pass to trace_span, 0 when the tracing is
+// disabled.
+uint64_t trace_now(void);
+
+// Records a span started at 'start' and ending now. The 'name' has to
+// be a string literal.
+void trace_span(const char *name, uint64_t start, long arg);
+
+// Records an event without duration.
+void trace_instant(const char *name, long arg);
+
+#endif
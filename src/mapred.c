@@ -45,12 +45,22 @@ void *scality_map(void *in)
 	while (input_split) {
 		DEBUG_MSG("Map executed for: '%p'\n", input_split->value);
 
+		// strtok_r is modifying the line, the input_split has
+		// to be kept intact in case of the task is retried.
+		char *line = strdup(input_split->value);
+		if (line == NULL)
+			return TASK_FAILED;
+
 		char *context;
-		char *word = strtok_r(input_split->value, " ,.", &context);
+		char *word = strtok_r(line, " ,.", &context);
 		while (word != NULL) {
-			emit(word, &value, sizeof(char) * strlen(word) + 1);
+			if (emit(word, &value, sizeof(value)) == -1) {
+				free(line);
+				return TASK_FAILED;
+			}
 			word = strtok_r(NULL, " ,.", &context);
 		}
+		free(line);
 		input_split = input_split->next;
 	}
 	return NULL;
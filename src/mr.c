@@ -25,14 +25,110 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <assert.h>
+#include <limits.h>
+#include <time.h>
+#include <stdint.h>
 
 #include "include/mr.h"
+#include "include/trace.h"
 
 // in-memory storage
 static struct hentry *storage = NULL;
 static size_t storage_index = 0;
+static size_t storage_space = 0;
 static pthread_mutex_t storage_lock;
 
+// In a pipeline, the storage of a stage is kept aside while the next
+// stage is mapping its result since the result can reference it.
+struct stage_storage {
+	struct hentry *storage;
+	size_t index;
+	size_t space;
+};
+
+// A map task is the unit of work executed by a thread, it is the
+// bucket of input_splits built by 'distribute'. Each execution of a
+// task, an attempt, records the key/value emitted in its own output
+// which is only kept once the attempt has succeeded, that makes a
+// task idempotent: a failed attempt is discarded and executed again.
+struct task_record {
+	char *key;
+	void *value;
+	unsigned int vsize;
+};
+
+struct task_output {
+	struct task_record *records;
+	size_t nrecords;
+	size_t space;
+};
+
+// A task has at most two attempts running at the same time, when a
+// backup of a straggler is executed. The output of the first one to
+// succeed is kept, the other one is cancelled.
+#define TASK_MAX_RUNNING 2
+
+struct attempt {
+	struct task *task;
+	pthread_t thread;
+	struct timespec start;
+	unsigned int number;
+
+	// Number of input_splits processed and flag to stop the
+	// attempt, accessed with atomic operations.
+	unsigned int progress;
+	int cancelled;
+
+	// Only written by the thread executing the attempt, 'finished'
+	// is protected by sched_lock.
+	int failed;
+	int finished;
+
+	struct task_output output;
+};
+
+struct task {
+	unsigned int id;
+	unsigned int stage;
+	struct operations *op;
+	struct input_split *input;
+	unsigned int nsplits;
+
+	unsigned int attempts;
+	unsigned int failures;
+	int speculated;
+	int done;
+
+	struct attempt *running[TASK_MAX_RUNNING];
+	struct task_output output;
+};
+
+#define TASK_INITIAL_RECORDS 64
+
+// Header of the run file where a completed task commits its output,
+// followed by 'nrecords' times the key length, the value size, the
+// key and the value. The 'jobid' is a hash of the identifier of the
+// job, the other fields only check that the input has the same shape.
+#define RUN_FILE_MAGIC "MRRUN002"
+
+struct run_header {
+	char magic[8];
+	uint64_t jobid;
+	unsigned int id;
+	unsigned int ntasks;
+	unsigned int nsplits;
+	unsigned int nrecords;
+};
+
+// Ref of the attempt executed by the current thread, NULL if the
+// thread is not executing a map task.
+static pthread_key_t current_attempt;
+static pthread_once_t current_attempt_once = PTHREAD_ONCE_INIT;
+
+// The attempts signal the scheduler when they have finished.
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sched_cond = PTHREAD_COND_INITIALIZER;
+
 // cmp function used to find key in storage, O(n).
 static int cmp(const void *key, const void *obj)
 {
@@ -40,6 +136,13 @@ static int cmp(const void *key, const void *obj)
 	return strcmp(key, e->key);
 }
 
+static int cmp_double(const void *o1, const void *o2)
+{
+	double d1 = *(const double *)o1;
+	double d2 = *(const double *)o2;
+	return (d1 > d2) - (d1 < d2);
+}
+
 // Releases allocated memory for the input_split LL
 void input_split_deallocate(struct input_split *input)
 {
@@ -54,12 +157,26 @@ void input_split_deallocate(struct input_split *input)
 	}
 }
 
-// Releases allocated memory for the in-memory storage
-static void storage_deallocate()
+// Releases only the nodes of the input_split LL, the values are
+// owned by someone else.
+static void input_split_deallocate_nodes(struct input_split *input)
 {
-	for (int i = 0; i < storage_index; i++) {
-		if (storage[i].root) {
-			struct hentry_value *node = storage[i].root;
+	struct input_split *next = NULL;
+	while (input) {
+		next = input->next;
+		free(input);
+
+		input = next;
+	}
+}
+
+// Releases allocated memory for the entries of a storage
+static void hentries_deallocate(struct hentry *entries, size_t size)
+{
+	for (int i = 0; i < size; i++) {
+		free(entries[i].key);
+		if (entries[i].root) {
+			struct hentry_value *node = entries[i].root;
 			// For each value entry we need to release
 			// memory for the value and the node itself.
 			while (node) {
@@ -70,10 +187,29 @@ static void storage_deallocate()
 			}
 		}
 	}
-	free(storage);
+	free(entries);
+}
+
+// Releases allocated memory for the in-memory storage
+static void storage_deallocate()
+{
+	hentries_deallocate(storage, storage_index);
+
+	storage = NULL;
+	storage_index = 0;
+	storage_space = 0;
+}
+
+// Moves the in-memory storage aside, the storage is then empty.
+static void storage_detach(struct stage_storage *st)
+{
+	st->storage = storage;
+	st->index = storage_index;
+	st->space = storage_space;
 
 	storage = NULL;
 	storage_index = 0;
+	storage_space = 0;
 }
 
 static int storage_init(int size)
@@ -89,30 +225,26 @@ static int storage_init(int size)
 	return 0;
 }
 
+// On error the storage is left untouched.
 static int storage_realloc(int newsize)
 {
-	storage = realloc(storage, newsize);
-	if (storage == NULL) {
+	struct hentry *s = realloc(storage, newsize);
+	if (s == NULL) {
 		fprintf(stderr,
 			"Unable to re-allocate storage memory, %s\n",
 			strerror(errno));
 		return -1;
 	}
+	storage = s;
 	return 0;
 }
 
-// TODO(sahid): refactor needed, some part are redondantes and we
-// could probably have specific functions to allocate memory of hentry...
-int emit(char *key, void *value, unsigned int vsize)
+// Appends the key/value in the storage, the storage takes ownership
+// of both the key and the value unless -1 is returned. The caller is
+// expected to hold the storage lock.
+static int storage_append(char *key, void *value)
 {
-	static unsigned int space = 0;
 	struct hentry *e = NULL;
-	int ret = 0;
-
-	DEBUG_MSG("Emit %s=%p\n", key, value);
-
-	// Global lock... probably not the best way
-	pthread_mutex_lock(&storage_lock);
 
 	// Init the storage whether is not already done.  The algo is
 	// using a simple array so the performance can not be optimal
@@ -124,11 +256,9 @@ int emit(char *key, void *value, unsigned int vsize)
 		DEBUG_MSG
 		    ("Initialize in-memory storage, default size=%d entries\n",
 		     STORAGE_INITIAL_SIZE);
-		if (storage_init(STORAGE_INITIAL_SIZE) == -1) {
-			ret = -1;
-			goto unlock;
-		}
-		space = STORAGE_INITIAL_SIZE;
+		if (storage_init(STORAGE_INITIAL_SIZE) == -1)
+			return -1;
+		storage_space = STORAGE_INITIAL_SIZE;
 	}
 	// Search whether the entry already exists. If that the case
 	// so we happen the value to the refered key, if not so we
@@ -148,50 +278,153 @@ int emit(char *key, void *value, unsigned int vsize)
 		if (curr->next == NULL) {
 			fprintf(stderr, "Unable to allocate value memory, %s\n",
 				strerror(errno));
-			ret = -1;
-			goto unlock;
+			return -1;
 		}
-		curr->next->value = malloc(vsize);
-		memcpy(curr->next->value, value, vsize);
+		curr->next->value = value;
 		curr->next->next = NULL;
+
+		// The key is already referenced by the entry.
+		free(key);
 	} else {
 		DEBUG_MSG("Key '%s' not found in storage, appening value=%p\n",
 			  key, value);
 		// First we want to ensure they is enough space is the storage
-		if (storage_index >= space) {
+		if (storage_index >= storage_space) {
 			DEBUG_MSG
-			    ("Extra space needed in storage idx=%ld, space=%d\n",
-			     storage_index, space);
+			    ("Extra space needed in storage idx=%ld, space=%ld\n",
+			     storage_index, storage_space);
 			// We need to increase the size of the storage.
-			space = ceil(space * STORAGE_INCR_RATIO);
+			size_t space = ceil(storage_space * STORAGE_INCR_RATIO);
 			if (storage_realloc(sizeof(struct hentry) * space) ==
-			    -1) {
-				ret = -1;
-				goto unlock;
-			}
+			    -1)
+				return -1;
+			storage_space = space;
 		}
 		// Here, we want to add a new hentry in the storage and store the
 		// value.
-		storage[storage_index].key = key;
 		storage[storage_index].root =
 		    malloc(sizeof(struct hentry_value));
 		if (storage[storage_index].root == NULL) {
 			fprintf(stderr, "Unable to allocate value memory, %s\n",
 				strerror(errno));
-			ret = -1;
-			goto unlock;
+			return -1;
 		}
-		storage[storage_index].root->value = malloc(vsize);
-		memcpy(storage[storage_index].root->value, value, vsize);
+		storage[storage_index].key = key;
+		storage[storage_index].root->value = value;
 		storage[storage_index].root->next = NULL;
 
 		// Increment the storage index position
 		storage_index++;
 	}
+	return 0;
+}
 
- unlock:
+// Copies key and value in newly allocated memory.
+static int record_dup(char *key, void *value, unsigned int vsize,
+		      char **k, void **v)
+{
+	*k = strdup(key);
+	*v = malloc(vsize);
+	if (*k == NULL || *v == NULL) {
+		fprintf(stderr, "Unable to allocate record memory, %s\n",
+			strerror(errno));
+		free(*k);
+		free(*v);
+		return -1;
+	}
+	memcpy(*v, value, vsize);
+	return 0;
+}
+
+static void current_attempt_init(void)
+{
+	if (pthread_key_create(&current_attempt, NULL) != 0) {
+		fprintf(stderr, "Unable to create attempt key\n");
+		abort();
+	}
+}
+
+// Records a copy of the key/value in the output. An output is only
+// written by one thread so there is no need of lock.
+static int output_append(struct task_output *out, char *key, void *value,
+			 unsigned int vsize)
+{
+	struct task_record *r = NULL;
+
+	if (out->nrecords >= out->space) {
+		size_t space = out->space ? out->space * 2 :
+		    TASK_INITIAL_RECORDS;
+		r = realloc(out->records, sizeof(struct task_record) * space);
+		if (r == NULL) {
+			fprintf(stderr,
+				"Unable to allocate task records, %s\n",
+				strerror(errno));
+			return -1;
+		}
+		out->records = r;
+		out->space = space;
+	}
+	r = &out->records[out->nrecords];
+	if (record_dup(key, value, vsize, &r->key, &r->value) == -1)
+		return -1;
+	r->vsize = vsize;
+	out->nrecords++;
+	return 0;
+}
+
+// Releases the records of the output.
+static void output_discard(struct task_output *out)
+{
+	for (size_t i = 0; i < out->nrecords; i++) {
+		free(out->records[i].key);
+		free(out->records[i].value);
+	}
+	free(out->records);
+
+	out->records = NULL;
+	out->nrecords = 0;
+	out->space = 0;
+}
+
+int emit(char *key, void *value, unsigned int vsize)
+{
+	struct attempt *a = NULL;
+	char *k = NULL;
+	void *v = NULL;
+	int ret = 0;
+
+	DEBUG_MSG("Emit %s=%p\n", key, value);
+
+	// Called from a map task, on error the attempt is flagged as
+	// failed so its output is discarded.
+	pthread_once(&current_attempt_once, current_attempt_init);
+	a = pthread_getspecific(current_attempt);
+	if (a) {
+		TRACE_PROBE(emit, a->task->id);
+		trace_instant("emit", a->task->id);
+		ret = output_append(&a->output, key, value, vsize);
+		if (ret == -1)
+			a->failed = 1;
+		return ret;
+	}
+
+	// Not called from a map task, the key/value is directly
+	// stored.
+	if (record_dup(key, value, vsize, &k, &v) == -1)
+		return -1;
+
+	// Global lock... probably not the best way
+	TRACE_PROBE(emit, -1);
+	uint64_t start = trace_now();
+	pthread_mutex_lock(&storage_lock);
+	trace_span("lock", start, -1);
+	ret = storage_append(k, v);
 	pthread_mutex_unlock(&storage_lock);
 
+	if (ret == -1) {
+		free(k);
+		free(v);
+	}
 	return ret;
 }
 
@@ -327,25 +560,442 @@ void distribute(struct input_split *input, struct input_split *buckets[],
 	assert(input == NULL);
 }
 
-// Is where everything start
-int operate(struct operations *op, void *params, unsigned int numthreads)
+static void task_init(struct task *task, unsigned int id, unsigned int stage,
+		      struct operations *op, struct input_split *input)
 {
+	memset(task, 0, sizeof(struct task));
+	task->id = id;
+	task->stage = stage;
+	task->op = op;
+	task->input = input;
+	for (struct input_split *n = input; n; n = n->next)
+		task->nsplits++;
+}
 
-	if (numthreads < MIN_THREADS || numthreads > MAX_THREADS) {
-		fprintf(stderr, "Consider to use a range %d..%d for threads\n",
-			MIN_THREADS, MAX_THREADS);
+static int task_running(struct task *task)
+{
+	for (int j = 0; j < TASK_MAX_RUNNING; j++) {
+		if (task->running[j])
+			return 1;
+	}
+	return 0;
+}
+
+// Requests the running attempts of the task to stop, they are
+// checking it between two input_splits.
+static void task_cancel(struct task *task)
+{
+	for (int j = 0; j < TASK_MAX_RUNNING; j++) {
+		if (task->running[j])
+			__atomic_store_n(&task->running[j]->cancelled, 1,
+					 __ATOMIC_RELAXED);
+	}
+}
+
+// Returns the progress of the task between 0 and 1, the one of its
+// most advanced attempt.
+static double task_progress(struct task *task)
+{
+	unsigned int progress = 0;
+
+	if (task->done || task->nsplits == 0)
+		return 1;
+	for (int j = 0; j < TASK_MAX_RUNNING; j++) {
+		if (task->running[j]) {
+			unsigned int p =
+			    __atomic_load_n(&task->running[j]->progress,
+					    __ATOMIC_RELAXED);
+			if (p > progress)
+				progress = p;
+		}
+	}
+	return (double)progress / task->nsplits;
+}
+
+// Executed by pthread_create, runs the map function against the
+// input_splits of the task. The map is called for one input_split at
+// time to track the progress of the attempt and to stop it as soon
+// as possible when cancelled.
+static void *attempt_run(void *arg)
+{
+	struct attempt *a = arg;
+	struct task *task = a->task;
+	uint64_t start = trace_now();
+
+	TRACE_PROBE(map__start, task->id);
+	pthread_setspecific(current_attempt, a);
+	for (struct input_split *n = task->input; n; n = n->next) {
+		if (__atomic_load_n(&a->cancelled, __ATOMIC_RELAXED))
+			break;
+
+		// The input_split is shared with the other attempt of
+		// the task, it is not possible to unlink it.
+		struct input_split one = *n;
+		one.next = NULL;
+		if (task->op->map(&one) == TASK_FAILED)
+			a->failed = 1;
+		if (a->failed)
+			break;
+		__atomic_add_fetch(&a->progress, 1, __ATOMIC_RELAXED);
+	}
+	pthread_setspecific(current_attempt, NULL);
+	TRACE_PROBE(map__done, task->id);
+	trace_span(a->failed ? "map (failed)" :
+		   __atomic_load_n(&a->cancelled, __ATOMIC_RELAXED) ?
+		   "map (cancelled)" : "map", start, task->id);
+
+	pthread_mutex_lock(&sched_lock);
+	a->finished = 1;
+	pthread_cond_signal(&sched_cond);
+	pthread_mutex_unlock(&sched_lock);
+
+	return NULL;
+}
+
+// Starts a new attempt of the task in its own thread.
+static int attempt_start(struct task *task)
+{
+	struct attempt *a = NULL;
+	int slot = 0;
+
+	while (task->running[slot])
+		slot++;
+	assert(slot < TASK_MAX_RUNNING);
+
+	a = calloc(1, sizeof(struct attempt));
+	if (a == NULL) {
+		fprintf(stderr, "Unable to allocate attempt, %s\n",
+			strerror(errno));
 		return -1;
 	}
+	a->task = task;
+	a->number = ++task->attempts;
+	clock_gettime(CLOCK_MONOTONIC, &a->start);
 
-	struct input_split *buckets[numthreads];
-	struct input_split *input = NULL;
-	pthread_t mthreads[numthreads];
-	void *output = NULL;
-	unsigned int rsize = 0;
+	if (pthread_create(&a->thread, NULL, attempt_run, a)) {
+		fprintf(stderr, "Unable to create thread for task %d, %s\n",
+			task->id, strerror(errno));
+		free(a);
+		return -1;
+	}
+	DEBUG_MSG("Started task %d, attempt %d\n", task->id, a->number);
+
+	task->running[slot] = a;
+	return 0;
+}
+
+static long elapsed_ms(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 +
+	    (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+// Returns the hash of the job identifier stored in the run files.
+static uint64_t run_jobid(char *jobid)
+{
+	// FNV-1a
+	uint64_t h = 14695981039346656037ULL;
+
+	if (jobid == NULL)
+		return 0;
+	while (*jobid) {
+		h ^= (unsigned char)*jobid++;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+static void run_file_path(char *path, size_t size, char *rundir,
+			  unsigned int stage, unsigned int id,
+			  unsigned int ntasks)
+{
+	snprintf(path, size, "%s/stage-%u-task-%u-%u.run", rundir, stage,
+		 ntasks, id);
+}
+
+// Removes the run file of the task and the temporary one which can
+// be left by a job killed while committing it.
+static void run_file_remove(char *rundir, unsigned int stage,
+			    unsigned int id, unsigned int ntasks)
+{
+	char path[PATH_MAX];
+	char tmp[PATH_MAX + sizeof(".tmp")];
+
+	run_file_path(path, sizeof(path), rundir, stage, id, ntasks);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	unlink(path);
+	unlink(tmp);
+}
+
+// Writes the output of the task in its run file. The file is first
+// written under a temporary name, synced then renamed so a run file
+// is either complete or does not exist.
+static int task_commit(struct task *task, struct job_options *opts,
+		       unsigned int ntasks)
+{
+	char *rundir = opts->rundir;
+	char path[PATH_MAX];
+	char tmp[PATH_MAX + sizeof(".tmp")];
+	struct run_header h;
+	FILE *f = NULL;
+
+	run_file_path(path, sizeof(path), rundir, task->stage, task->id,
+		      ntasks);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+	// A previous job may have been killed while committing.
+	unlink(tmp);
+	f = fopen(tmp, "w");
+	if (f == NULL) {
+		fprintf(stderr, "Can't open run file '%s', %s\n", tmp,
+			strerror(errno));
+		return -1;
+	}
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, RUN_FILE_MAGIC, sizeof(h.magic));
+	h.jobid = run_jobid(opts->jobid);
+	h.id = task->id;
+	h.ntasks = ntasks;
+	h.nsplits = task->nsplits;
+	h.nrecords = task->output.nrecords;
+	if (fwrite(&h, sizeof(h), 1, f) != 1)
+		goto err;
+
+	for (size_t i = 0; i < task->output.nrecords; i++) {
+		struct task_record *r = &task->output.records[i];
+		unsigned int ksize = strlen(r->key) + 1;
+		if (fwrite(&ksize, sizeof(ksize), 1, f) != 1 ||
+		    fwrite(&r->vsize, sizeof(r->vsize), 1, f) != 1 ||
+		    fwrite(r->key, ksize, 1, f) != 1 ||
+		    (r->vsize && fwrite(r->value, r->vsize, 1, f) != 1))
+			goto err;
+	}
+
+	if (fflush(f) != 0 || fsync(fileno(f)) != 0)
+		goto err;
+	if (fclose(f) != 0) {
+		f = NULL;
+		goto err;
+	}
+	f = NULL;
+
+	if (rename(tmp, path) != 0)
+		goto err;
+
+	DEBUG_MSG("Committed task %d, %ld records in '%s'\n", task->id,
+		  task->output.nrecords, path);
+	return 0;
+
+ err:
+	fprintf(stderr, "Unable to commit run file '%s', %s\n", path,
+		strerror(errno));
+	if (f)
+		fclose(f);
+	unlink(tmp);
+	return -1;
+}
+
+// Loads the output of the task from its run file whether a previous
+// execution of the job has committed it. Returns 0 when the task does
+// not have to be executed again.
+static int task_resume(struct task *task, struct job_options *opts,
+		       unsigned int ntasks)
+{
+	char *rundir = opts->rundir;
+	char path[PATH_MAX];
+	struct run_header h;
+	FILE *f = NULL;
+
+	run_file_path(path, sizeof(path), rundir, task->stage, task->id,
+		      ntasks);
+	f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+
+	if (fread(&h, sizeof(h), 1, f) != 1 ||
+	    memcmp(h.magic, RUN_FILE_MAGIC, sizeof(h.magic)) != 0 ||
+	    h.jobid != run_jobid(opts->jobid) || h.id != task->id ||
+	    h.ntasks != ntasks || h.nsplits != task->nsplits)
+		goto err;
+
+	for (unsigned int i = 0; i < h.nrecords; i++) {
+		unsigned int ksize, vsize;
+		char *key = NULL;
+		void *value = NULL;
+		int ret = 0;
+
+		if (fread(&ksize, sizeof(ksize), 1, f) != 1 ||
+		    fread(&vsize, sizeof(vsize), 1, f) != 1 || ksize == 0)
+			goto err;
+		key = malloc(ksize);
+		value = malloc(vsize ? vsize : 1);
+		if (key && value && fread(key, ksize, 1, f) == 1 &&
+		    (!vsize || fread(value, vsize, 1, f) == 1) &&
+		    key[ksize - 1] == '\0')
+			ret = output_append(&task->output, key, value,
+					    vsize);
+		else
+			ret = -1;
+		free(key);
+		free(value);
+		if (ret == -1)
+			goto err;
+	}
+	fclose(f);
+
+	DEBUG_MSG("Resumed task %d, %ld records from '%s'\n", task->id,
+		  task->output.nrecords, path);
+	return 0;
+
+ err:
+	fprintf(stderr, "Ignoring invalid run file '%s'\n", path);
+	fclose(f);
+	output_discard(&task->output);
+	return -1;
+}
+
+// Moves the output of the task in the storage.
+static int task_merge(struct task *task)
+{
+	struct task_output *out = &task->output;
+	uint64_t start = trace_now();
 	int ret = 0;
 
-	// Generate inputs wich will be passed to the map function
-	input = op->inputify(params);
+	TRACE_PROBE(merge__start, task->id);
+	pthread_mutex_lock(&storage_lock);
+	trace_span("lock", start, task->id);
+	for (size_t i = 0; i < out->nrecords; i++) {
+		struct task_record *r = &out->records[i];
+		if (storage_append(r->key, r->value) == -1) {
+			// Records not yet moved are going to be
+			// released with the task.
+			memmove(out->records, r,
+				sizeof(struct task_record) *
+				(out->nrecords - i));
+			out->nrecords -= i;
+			ret = -1;
+			goto unlock;
+		}
+	}
+	out->nrecords = 0;
+
+ unlock:
+	pthread_mutex_unlock(&storage_lock);
+	TRACE_PROBE(merge__done, task->id);
+	trace_span("merge", start, task->id);
+	return ret;
+}
+
+// Joins the finished attempts of the task. The output of the first
+// one to succeed is kept and the other attempt is cancelled. Called
+// with sched_lock held.
+static void task_reap(struct task *task, struct job_options *opts,
+		      unsigned int ntasks, unsigned int *running)
+{
+	for (int j = 0; j < TASK_MAX_RUNNING; j++) {
+		struct attempt *a = task->running[j];
+		if (a == NULL || !a->finished)
+			continue;
+
+		if (pthread_join(a->thread, NULL))
+			fprintf(stderr, "Unable to join task %d, attempt %d\n",
+				task->id, a->number);
+		DEBUG_MSG("Finished task %d, attempt %d\n", task->id,
+			  a->number);
+		task->running[j] = NULL;
+		(*running)--;
+
+		if (a->failed) {
+			fprintf(stderr, "Map task %d failed, attempt %d\n",
+				task->id, a->number);
+			task->failures++;
+		} else if (!task->done && !a->cancelled) {
+			task->output = a->output;
+			memset(&a->output, 0, sizeof(struct task_output));
+			task->done = 1;
+			task_cancel(task);
+
+			// The output is in memory so a task which
+			// can't be committed is considered as done,
+			// only its checkpoint is lost. The attempts
+			// do not access the task, no need to keep
+			// the lock during the I/O.
+			if (opts->rundir) {
+				pthread_mutex_unlock(&sched_lock);
+				task_commit(task, opts, ntasks);
+				pthread_mutex_lock(&sched_lock);
+			}
+		}
+		output_discard(&a->output);
+		free(a);
+	}
+}
+
+// Starts a backup attempt on the idle threads for the tasks which are
+// far behind the median progress. Called with sched_lock held.
+static void speculate(struct task tasks[], unsigned int ntasks,
+		      unsigned int *running, unsigned int numthreads)
+{
+	double progress[ntasks];
+	double sorted[ntasks];
+	double median = 0;
+
+	for (int i = 0; i < ntasks; i++) {
+		progress[i] = task_progress(&tasks[i]);
+		sorted[i] = progress[i];
+	}
+	qsort(sorted, ntasks, sizeof(double), cmp_double);
+	median = sorted[ntasks / 2];
+
+	for (int i = 0; i < ntasks && *running < numthreads; i++) {
+		struct task *t = &tasks[i];
+
+		// Only one backup per task.
+		if (t->done || t->speculated || !t->running[0] ||
+		    elapsed_ms(&t->running[0]->start) <
+		    SPECULATIVE_MIN_ELAPSED_MS ||
+		    progress[i] >= median * SPECULATIVE_SLOWNESS)
+			continue;
+
+		DEBUG_MSG("Task %d is a straggler, progress=%f median=%f\n",
+			  i, progress[i], median);
+		trace_instant("speculate", i);
+		t->speculated = 1;
+		if (attempt_start(t) == 0)
+			(*running)++;
+	}
+}
+
+// Waits an attempt to finish or the next speculation interval. Called
+// with sched_lock held.
+static void sched_wait()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += SPECULATIVE_INTERVAL_MS * 1000000L;
+	ts.tv_sec += ts.tv_nsec / 1000000000L;
+	ts.tv_nsec %= 1000000000L;
+	pthread_cond_timedwait(&sched_cond, &sched_lock, &ts);
+}
+
+// Executes the map tasks of the stage of a job against the input,
+// then reduces the output. The input_splits are released with
+// 'release'. On success the storage is left populated, the caller is
+// responsible to release it once the result is not used anymore.
+static int job_run(struct operations *op, struct input_split *input,
+		   unsigned int numthreads, struct job_options *opts,
+		   unsigned int stage, void (*release) (struct input_split *),
+		   void **output, unsigned int *rsize)
+{
+	struct input_split *buckets[numthreads];
+	struct task tasks[numthreads];
+	unsigned int running = 0;
+	int ret = 0;
 
 	distribute(input, buckets, numthreads);
 
@@ -360,52 +1010,224 @@ int operate(struct operations *op, void *params, unsigned int numthreads)
 	}
 #endif
 
+	// Each bucket is a task, the ones already committed by a
+	// previous execution of the job do not need to be executed.
+	pthread_once(&current_attempt_once, current_attempt_init);
+	for (int i = 0; i < numthreads; i++) {
+		task_init(&tasks[i], i, stage, op, buckets[i]);
+		if (opts->rundir &&
+		    task_resume(&tasks[i], opts, numthreads) == 0)
+			tasks[i].done = 1;
+	}
+
 	// Init the lock
 	if (pthread_mutex_init(&storage_lock, NULL) != 0) {
 		fprintf(stderr, "Unable to init lock, %s\n", strerror(errno));
 		ret = -1;
 		goto free;
 	}
-	// Start the threads of map functions
-	for (int i = 0; i < numthreads; i++) {
-		if (pthread_create(&mthreads[i], NULL, op->map, buckets[i])) {
-			fprintf(stderr, "Unable to create thread %d, %s\n", i,
-				strerror(errno));
-			ret = -1;
-			goto free;
+	// Start the attempts of the tasks which are not yet done, at
+	// most one thread per task plus the backups started on idle
+	// threads. A failed task is executed again until it has
+	// reached the number of retries, in that case the job is
+	// aborted once the running attempts have stopped.
+	pthread_mutex_lock(&sched_lock);
+	for (;;) {
+		unsigned int pending = 0;
 
+		for (int i = 0; i < numthreads; i++)
+			task_reap(&tasks[i], opts, numthreads, &running);
+
+		for (int i = 0; i < numthreads; i++) {
+			struct task *t = &tasks[i];
+
+			// A cancelled attempt of a done task has still
+			// to be joined.
+			if (task_running(t)) {
+				if (ret == -1)
+					task_cancel(t);
+				pending++;
+				continue;
+			}
+			if (t->done)
+				continue;
+			if (ret == -1)
+				continue;
+			if (t->failures > opts->retries) {
+				fprintf(stderr,
+					"Map task %d failed after %d attempts\n",
+					i, t->attempts);
+				ret = -1;
+				continue;
+			}
+			pending++;
+			if (running < numthreads) {
+				if (attempt_start(t) == 0)
+					running++;
+				else
+					t->failures++;
+			}
 		}
-		DEBUG_MSG("Started thread: %d\n", i);
+		if (!pending)
+			break;
+
+		if (ret == 0 && opts->speculative)
+			speculate(tasks, numthreads, &running, numthreads);
+		sched_wait();
 	}
+	pthread_mutex_unlock(&sched_lock);
 
-	// Wait for all threads before to start reducing phase
+	if (ret == -1)
+		goto free;
+
+	// Merging the output of the tasks in their order so the
+	// storage does not depend of the scheduling.
 	for (int i = 0; i < numthreads; i++) {
-		if (pthread_join(mthreads[i], NULL)) {
-			fprintf(stderr, "Unable to join thread %i\n", i);
+		if (task_merge(&tasks[i]) == -1) {
 			ret = -1;
 			goto free;
 		}
-		DEBUG_MSG("Finished thread: %d\n", i);
 	}
 
 	// The map process have finished their job with the documents
 	// split to we can freing the resources allocated.
-	rsize = op->reduce(storage, storage_index, &output);
-	DEBUG_MSG("Reducing phase produced %d elements\n", rsize);
-
-	op->outputify(output, rsize);
+	uint64_t start = trace_now();
+	TRACE_PROBE(reduce__start, stage);
+	*rsize = op->reduce(storage, storage_index, output);
+	TRACE_PROBE(reduce__done, stage);
+	trace_span("reduce", start, stage);
+	DEBUG_MSG("Reducing phase produced %d elements\n", *rsize);
 
  free:
 	// Release lock
 	pthread_mutex_destroy(&storage_lock);
 
-	// Release inputs
+	// Release inputs and output of the tasks
 	for (int i = 0; i < numthreads; i++) {
-		input_split_deallocate(buckets[i]);
+		output_discard(&tasks[i].output);
+		release(buckets[i]);
 	}
 
+	// Release in-memory storage whether the stage has failed.
+	if (ret == -1)
+		storage_deallocate();
+
+	return ret;
+}
+
+static struct job_options default_options = {
+	NULL,
+	NULL,
+	TASK_MAX_RETRIES,
+	1,
+};
+
+// Is where everything start
+int operate_with(struct operations *op, void *params, unsigned int numthreads,
+		 struct job_options *opts)
+{
+	struct operations *stages[] = { op };
+
+	return pipeline(stages, 1, params, numthreads, opts);
+}
+
+int operate(struct operations *op, void *params, unsigned int numthreads)
+{
+	return operate_with(op, params, numthreads, NULL);
+}
+
+int pipeline(struct operations *stages[], unsigned int nstages, void *params,
+	     unsigned int numthreads, struct job_options *opts)
+{
+	if (numthreads < MIN_THREADS || numthreads > MAX_THREADS) {
+		fprintf(stderr, "Consider to use a range %d..%d for threads\n",
+			MIN_THREADS, MAX_THREADS);
+		return -1;
+	}
+	if (stages == NULL || nstages < 1) {
+		fprintf(stderr, "A pipeline needs at least one stage\n");
+		return -1;
+	}
+	for (int k = 0; k + 1 < nstages; k++) {
+		if (stages[k]->forward == NULL) {
+			fprintf(stderr, "Stage %d can't forward its result\n",
+				k);
+			return -1;
+		}
+	}
+	if (opts == NULL)
+		opts = &default_options;
+
+	struct stage_storage prev = { NULL, 0, 0 };
+	struct input_split *input = NULL;
+	char *trace = opts->trace ? opts->trace : getenv(TRACE_ENV);
+	void *output = NULL;
+	unsigned int rsize = 0;
+	uint64_t start = 0;
+	int ret = 0;
+
+	if (trace)
+		trace_start();
+
+	// Generate inputs wich will be passed to the map function
+	start = trace_now();
+	input = stages[0]->inputify(params);
+	trace_span("inputify", start, 0);
+
+	for (int k = 0; k < nstages; k++) {
+		struct operations *op = stages[k];
+		void *result = NULL;
+		unsigned int size = 0;
+
+		// The inputs of the next stages are referencing the
+		// result of the previous stage, only their nodes are
+		// released.
+		start = trace_now();
+		ret = job_run(op, input, numthreads, opts, k,
+			      k ? input_split_deallocate_nodes :
+			      input_split_deallocate, &result, &size);
+		trace_span("stage", start, k);
+
+		// The previous stage is not needed anymore, even when
+		// this one has failed.
+		if (k) {
+			start = trace_now();
+			if (stages[k - 1]->release)
+				stages[k - 1]->release(output, rsize);
+			hentries_deallocate(prev.storage, prev.index);
+			trace_span("release", start, k - 1);
+		}
+		if (ret == -1)
+			goto out;
+
+		output = result;
+		rsize = size;
+		if (k + 1 < nstages) {
+			input = op->forward(output, rsize);
+			storage_detach(&prev);
+		}
+	}
+
+	start = trace_now();
+	stages[nstages - 1]->outputify(output, rsize);
+	trace_span("outputify", start, nstages - 1);
+
 	// Release in-memory storage.
 	storage_deallocate();
 
+	// The job is done, the checkpoints of its stages are not
+	// needed anymore. They are kept whether a stage has failed so
+	// a restarted job does not compute again the previous stages.
+	if (opts->rundir) {
+		for (int k = 0; k < nstages; k++) {
+			for (int i = 0; i < numthreads; i++)
+				run_file_remove(opts->rundir, k, i,
+						numthreads);
+		}
+	}
+
+ out:
+	if (trace && trace_stop(trace) == 0)
+		fprintf(stderr, "Trace written in '%s'\n", trace);
 	return ret;
 }
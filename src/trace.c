@@ -0,0 +1,206 @@
+/*
+ * Copyright (C) 2017 Sahid Orentino Ferdjaoui
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "include/trace.h"
+
+struct trace_event {
+	const char *name;
+	char phase;
+	uint64_t ts;
+	uint64_t dur;
+	long arg;
+};
+
+// Ring buffer of a thread, 'head' is the number of events recorded
+// since the start, the last TRACE_BUFFER_SIZE ones are kept. Only the
+// owner thread writes in it.
+struct trace_buffer {
+	unsigned int tid;
+	uint64_t head;
+	struct trace_event events[TRACE_BUFFER_SIZE];
+
+	struct trace_buffer *next;
+};
+
+int trace_enabled = 0;
+
+// All the buffers allocated since the start, the threads of the map
+// tasks are not living until the export.
+static struct trace_buffer *buffers = NULL;
+static unsigned int next_tid = 0;
+static uint64_t origin = 0;
+
+static pthread_key_t current_buffer;
+static pthread_once_t current_buffer_once = PTHREAD_ONCE_INIT;
+
+static void current_buffer_init(void)
+{
+	if (pthread_key_create(&current_buffer, NULL) != 0) {
+		fprintf(stderr, "Unable to create trace key\n");
+		abort();
+	}
+}
+
+static uint64_t clock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Returns the buffer of the current thread, allocated and registered
+// on first use.
+static struct trace_buffer *buffer_get(void)
+{
+	struct trace_buffer *b = NULL;
+
+	b = pthread_getspecific(current_buffer);
+	if (b)
+		return b;
+
+	b = calloc(1, sizeof(struct trace_buffer));
+	if (b == NULL)
+		return NULL;
+	b->tid = __atomic_add_fetch(&next_tid, 1, __ATOMIC_RELAXED);
+
+	// Lock-free push in the list of buffers.
+	b->next = __atomic_load_n(&buffers, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&buffers, &b->next, b, 0,
+					    __ATOMIC_RELEASE,
+					    __ATOMIC_RELAXED))
+		;
+
+	pthread_setspecific(current_buffer, b);
+	return b;
+}
+
+static void record(const char *name, char phase, uint64_t ts, uint64_t dur,
+		   long arg)
+{
+	struct trace_buffer *b = buffer_get();
+	struct trace_event *e = NULL;
+
+	if (b == NULL)
+		return;
+	e = &b->events[b->head % TRACE_BUFFER_SIZE];
+	e->name = name;
+	e->phase = phase;
+	e->ts = ts;
+	e->dur = dur;
+	e->arg = arg;
+	b->head++;
+}
+
+void trace_start(void)
+{
+	pthread_once(&current_buffer_once, current_buffer_init);
+	origin = clock_ns();
+	__atomic_store_n(&trace_enabled, 1, __ATOMIC_RELAXED);
+}
+
+uint64_t trace_now(void)
+{
+	if (!trace_on())
+		return 0;
+	return clock_ns();
+}
+
+void trace_span(const char *name, uint64_t start, long arg)
+{
+	if (!trace_on() || start == 0)
+		return;
+	record(name, 'X', start, clock_ns() - start, arg);
+}
+
+void trace_instant(const char *name, long arg)
+{
+	if (!trace_on())
+		return;
+	record(name, 'i', clock_ns(), 0, arg);
+}
+
+static void write_event(FILE *f, struct trace_event *e, unsigned int tid,
+			int first)
+{
+	fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":%d,"
+		"\"tid\":%u,\"ts\":%.3f", first ? "" : ",", e->name,
+		e->phase, (int)getpid(), tid,
+		e->ts > origin ? (e->ts - origin) / 1000.0 : 0);
+	if (e->phase == 'X')
+		fprintf(f, ",\"dur\":%.3f", e->dur / 1000.0);
+	else
+		fprintf(f, ",\"s\":\"t\"");
+	fprintf(f, ",\"args\":{\"arg\":%ld}}", e->arg);
+}
+
+int trace_stop(const char *path)
+{
+	struct trace_buffer *b = NULL;
+	FILE *f = NULL;
+	int first = 1;
+	int ret = 0;
+
+	__atomic_store_n(&trace_enabled, 0, __ATOMIC_RELAXED);
+
+	f = fopen(path, "w");
+	if (f == NULL) {
+		fprintf(stderr, "Can't open trace file '%s', %s\n", path,
+			strerror(errno));
+		ret = -1;
+	} else {
+		fprintf(f, "{\"traceEvents\":[");
+	}
+
+	b = __atomic_load_n(&buffers, __ATOMIC_ACQUIRE);
+	while (b) {
+		struct trace_buffer *next = b->next;
+		uint64_t i = b->head > TRACE_BUFFER_SIZE ?
+		    b->head - TRACE_BUFFER_SIZE : 0;
+
+		for (; f && i < b->head; i++) {
+			write_event(f, &b->events[i % TRACE_BUFFER_SIZE],
+				    b->tid, first);
+			first = 0;
+		}
+		free(b);
+		b = next;
+	}
+	buffers = NULL;
+
+	// The buffers of the other threads are gone with them.
+	pthread_setspecific(current_buffer, NULL);
+
+	if (f) {
+		fprintf(f, "\n]}\n");
+		if (fclose(f) != 0) {
+			fprintf(stderr, "Unable to write trace file '%s', %s\n",
+				path, strerror(errno));
+			ret = -1;
+		}
+	}
+	return ret;
+}
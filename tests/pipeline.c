@@ -0,0 +1,241 @@
+/*
+ * Copyright (C) 2017 Sahid Orentino Ferdjaoui
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <assert.h>
+
+#include "include/mr.h"
+
+// Testing a pipeline counting the words then computing the histogram
+// of the counts, the words are referencing the storage of the first
+// stage. The pipeline is also traced and resumed from its run files.
+
+static char *words[] = {"aa", "bb", "bb", "cc", "cc", "cc", "dd", "dd"};
+
+struct count {
+	char *word;
+	unsigned int count;
+};
+
+static int released;
+
+// Number of executions of the map of the first stage and whether the
+// map of the second stage fails.
+static int wc_executed;
+static int histo_fails;
+
+// Returns the content of the file, to be released by the caller.
+static char *read_file(int fd)
+{
+	struct stat st;
+	char *buf = NULL;
+	size_t n = 0;
+
+	assert(fstat(fd, &st) == 0);
+	buf = malloc(st.st_size + 1);
+	assert(buf);
+	while (n < st.st_size) {
+		ssize_t r = read(fd, buf + n, st.st_size - n);
+		assert(r > 0);
+		n += r;
+	}
+	buf[n] = '\0';
+	return buf;
+}
+
+struct input_split *test_inputify(void *p)
+{
+	struct input_split *root = NULL;
+	int n = sizeof(words) / sizeof(char *);
+
+	for (int i = n - 1; i >= 0; i--) {
+		struct input_split *s = malloc(sizeof(struct input_split));
+		s->key = i;
+		s->value = strdup(words[i]);
+		s->next = root;
+		root = s;
+	}
+	return root;
+}
+
+void *wc_map(void *in)
+{
+	static unsigned int one = 1;
+
+	__atomic_add_fetch(&wc_executed, 1, __ATOMIC_RELAXED);
+	for (struct input_split *n = in; n; n = n->next)
+		emit(n->value, &one, sizeof(one));
+	return NULL;
+}
+
+unsigned int wc_reduce(struct hentry *storage, unsigned int size,
+		       void **output)
+{
+	struct count *o = malloc(sizeof(struct count) * size);
+
+	for (int i = 0; i < size; i++) {
+		o[i].word = storage[i].key;
+		o[i].count = 0;
+		for (struct hentry_value *v = storage[i].root; v; v = v->next)
+			o[i].count += *((unsigned int *)v->value);
+	}
+	*output = o;
+	return size;
+}
+
+// Releases the result once the histogram stage has consumed it.
+void wc_release(void *reduced, unsigned int size)
+{
+	struct count *o = reduced;
+
+	assert(size == 4);
+	for (int i = 0; i < size; i++)
+		assert(strlen(o[i].word) == 2);
+	released = 1;
+	free(o);
+}
+
+// The splits are directly referencing the counts.
+struct input_split *wc_forward(void *reduced, unsigned int size)
+{
+	struct count *o = reduced;
+	struct input_split *root = NULL;
+
+	for (int i = size - 1; i >= 0; i--) {
+		struct input_split *s = malloc(sizeof(struct input_split));
+		s->key = i;
+		s->value = &o[i];
+		s->next = root;
+		root = s;
+	}
+	return root;
+}
+
+void *histo_map(void *in)
+{
+	static unsigned int one = 1;
+
+	if (histo_fails)
+		return TASK_FAILED;
+	for (struct input_split *n = in; n; n = n->next) {
+		struct count *c = n->value;
+		char key[16];
+
+		// The word is still available.
+		assert(c->word[0] == c->word[1]);
+		snprintf(key, sizeof(key), "%u", c->count);
+		emit(key, &one, sizeof(one));
+	}
+	return NULL;
+}
+
+int histo_output(void *reduced, unsigned int size)
+{
+	struct count *o = reduced;
+
+	assert(released);
+	assert(size == 3);
+	for (int i = 0; i < size; i++) {
+		if (strcmp(o[i].word, "2") == 0)
+			assert(o[i].count == 2);
+		else
+			assert(o[i].count == 1);
+	}
+	free(o);
+	return 0;
+}
+
+int main()
+{
+	struct operations wc = {
+		test_inputify,
+		wc_map,
+		wc_reduce,
+		NULL,
+		wc_forward,
+		wc_release,
+	};
+	struct operations histo = {
+		NULL,
+		histo_map,
+		wc_reduce,
+		histo_output,
+	};
+	struct operations *stages[] = { &wc, &histo };
+
+	for (int threads = 1; threads <= 3; threads++) {
+		released = 0;
+		assert(pipeline(stages, 2, NULL, threads, NULL) == 0);
+	}
+
+	// The trace contains the spans of both stages.
+	char trace[] = "/tmp/mr-trace-XXXXXX";
+	char *buf = NULL;
+	struct job_options opts = {
+		NULL,
+		NULL,
+		TASK_MAX_RETRIES,
+		1,
+		trace,
+	};
+	int fd = mkstemp(trace);
+	assert(fd != -1);
+	assert(pipeline(stages, 2, NULL, 2, &opts) == 0);
+	buf = read_file(fd);
+	assert(strncmp(buf, "{\"traceEvents\":[", 16) == 0);
+	assert(strstr(buf, "\"name\":\"map\""));
+	assert(strstr(buf, "\"name\":\"reduce\",\"ph\":\"X\""));
+	assert(strcmp(buf + strlen(buf) - 4, "\n]}\n") == 0);
+	free(buf);
+	close(fd);
+	unlink(trace);
+
+	// The second stage fails, a restarted pipeline resumes from the
+	// run files of the first stage. They are all removed once the
+	// pipeline has succeeded. The result of the first stage is
+	// released even though the second one has failed.
+	char rundir[] = "/tmp/mr-test-XXXXXX";
+	assert(mkdtemp(rundir));
+	opts.rundir = rundir;
+	opts.retries = 0;
+	opts.trace = NULL;
+	histo_fails = 1;
+	released = 0;
+	assert(pipeline(stages, 2, NULL, 2, &opts) == -1);
+	assert(released);
+	released = 0;
+	histo_fails = 0;
+	wc_executed = 0;
+	assert(pipeline(stages, 2, NULL, 2, &opts) == 0);
+	assert(wc_executed == 0);
+	assert(rmdir(rundir) == 0);
+
+	// A pipeline has at least one stage.
+	assert(pipeline(stages, 0, NULL, 1, NULL) == -1);
+	assert(pipeline(NULL, 1, NULL, 1, NULL) == -1);
+
+	// An intermediate stage has to forward its result.
+	wc.forward = NULL;
+	assert(pipeline(stages, 2, NULL, 1, NULL) == -1);
+
+	return 0;
+}
@@ -0,0 +1,201 @@
+/*
+ * Copyright (C) 2017 Sahid Orentino Ferdjaoui
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <limits.h>
+#include <assert.h>
+
+#include "include/mr.h"
+
+// Testing that failed map tasks are retried without their partial
+// output, that a restarted job resumes from the tasks committed by
+// the same job and that a backup of a straggler task does not emit
+// twice.
+
+#define SPLITS 8
+#define THREADS 2
+
+// Number of times the map function has been executed for each split.
+static int executed[SPLITS];
+
+// Number of attempts of the task handling split 1 which have to fail,
+// -1 to always fail.
+static int failures;
+
+static unsigned int total;
+
+// The thread executing the first attempt of the task handling split 1
+// is slow when 'straggle' is set.
+static int straggle;
+static int straggler_set;
+static pthread_t straggler;
+static pthread_mutex_t straggler_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct input_split *test_inputify(void *p)
+{
+	struct input_split *root = NULL;
+
+	for (int i = SPLITS - 1; i >= 0; i--) {
+		struct input_split *n = malloc(sizeof(struct input_split));
+		n->key = i;
+		n->value = strdup(i % 2 ? "odd" : "even");
+		n->next = root;
+		root = n;
+	}
+	return root;
+}
+
+void *test_map(void *in)
+{
+	static unsigned int one = 1;
+
+	for (struct input_split *n = in; n; n = n->next) {
+		if (straggle && n->key % 2) {
+			pthread_mutex_lock(&straggler_lock);
+			if (!straggler_set) {
+				straggler = pthread_self();
+				straggler_set = 1;
+			}
+			pthread_mutex_unlock(&straggler_lock);
+			if (pthread_equal(straggler, pthread_self())) {
+				struct timespec ts = { 0, 500000000 };
+				nanosleep(&ts, NULL);
+			}
+		}
+
+		pthread_mutex_lock(&straggler_lock);
+		executed[n->key]++;
+		pthread_mutex_unlock(&straggler_lock);
+		emit(n->value, &one, sizeof(one));
+
+		// The output already emitted by the task must be
+		// discarded.
+		if (n->key == 1 && failures) {
+			if (failures > 0)
+				failures--;
+			return TASK_FAILED;
+		}
+	}
+	return NULL;
+}
+
+unsigned int test_reduce(struct hentry *storage, unsigned int size,
+			 void **output)
+{
+	total = 0;
+	for (int i = 0; i < size; i++) {
+		unsigned int count = 0;
+		for (struct hentry_value *v = storage[i].root; v; v = v->next)
+			count += *((unsigned int *)v->value);
+		assert(count == SPLITS / 2);
+		total += count;
+	}
+	return size;
+}
+
+int test_output(void *reduced, unsigned int size)
+{
+	assert(size == 2);
+	return 0;
+}
+
+int main()
+{
+	struct operations op = {
+		test_inputify,
+		test_map,
+		test_reduce,
+		test_output,
+	};
+	char rundir[] = "/tmp/mr-test-XXXXXX";
+	struct job_options opts = {
+		NULL,
+		"job-a",
+		TASK_MAX_RETRIES,
+		0,
+	};
+
+	// The task is failing twice then succeeds.
+	failures = 2;
+	assert(operate_with(&op, NULL, THREADS, &opts) == 0);
+	assert(total == SPLITS);
+	assert(executed[1] == 3);
+	assert(executed[0] == 1);
+
+	// The task always fails, the job is aborted but the other
+	// task is committed.
+	assert(mkdtemp(rundir));
+	opts.rundir = rundir;
+	memset(executed, 0, sizeof(executed));
+	failures = -1;
+	total = 0;
+	assert(operate_with(&op, NULL, THREADS, &opts) == -1);
+	assert(executed[1] == TASK_MAX_RETRIES + 1);
+	assert(executed[0] == 1);
+	assert(total == 0);
+
+	// Restarting the job, only the failed task is executed. A
+	// temporary run file left by a killed commit is also removed.
+	char stale[PATH_MAX];
+	snprintf(stale, sizeof(stale), "%s/stage-0-task-%d-0.run.tmp",
+		 rundir, THREADS);
+	FILE *f = fopen(stale, "w");
+	assert(f && fclose(f) == 0);
+	memset(executed, 0, sizeof(executed));
+	failures = 0;
+	assert(operate_with(&op, NULL, THREADS, &opts) == 0);
+	assert(total == SPLITS);
+	assert(executed[1] == 1);
+	assert(executed[0] == 0);
+
+	// The run files of another job are ignored.
+	memset(executed, 0, sizeof(executed));
+	failures = -1;
+	assert(operate_with(&op, NULL, THREADS, &opts) == -1);
+	opts.jobid = "job-b";
+	memset(executed, 0, sizeof(executed));
+	failures = 0;
+	total = 0;
+	assert(operate_with(&op, NULL, THREADS, &opts) == 0);
+	assert(total == SPLITS);
+	assert(executed[0] == 1);
+	assert(executed[1] == 1);
+
+	// The run files are removed once the job has succeeded.
+	assert(rmdir(rundir) == 0);
+
+	// The first attempt of the task is slow, a backup is started
+	// and the output of only one of them is kept.
+	opts.rundir = NULL;
+	opts.speculative = 1;
+	memset(executed, 0, sizeof(executed));
+	straggle = 1;
+	total = 0;
+	assert(operate_with(&op, NULL, THREADS, &opts) == 0);
+	assert(total == SPLITS);
+	assert(executed[0] == 1);
+	assert(executed[1] == 2);
+	assert(executed[SPLITS - 1] == 1);
+
+	return 0;
+}
@@ -0,0 +1,187 @@
+/*
+ * Copyright (C) 2017 Sahid Orentino Ferdjaoui
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <assert.h>
+
+#include "include/mr_typed.h"
+
+// Testing the jobs generated for string->u64 and u64->double, their
+// sort, the failures of their map and their tracing.
+
+#define SPLITS 100
+#define SORTED 10000
+
+static const char *words[] = {"aa", "bb", "cc", "dd"};
+
+static inline uint64_t add(uint64_t a, uint64_t b)
+{
+	return a + b;
+}
+
+static inline double max(double a, double b)
+{
+	return a > b ? a : b;
+}
+
+MR_TYPED_JOB(wc, str, char *, uint64_t, add)
+MR_TYPED_JOB(mx, u64, uint64_t, double, max)
+
+// Returns the content of the file, to be released by the caller.
+static char *read_file(int fd)
+{
+	struct stat st;
+	char *buf = NULL;
+	size_t n = 0;
+
+	assert(fstat(fd, &st) == 0);
+	buf = malloc(st.st_size + 1);
+	assert(buf);
+	while (n < st.st_size) {
+		ssize_t r = read(fd, buf + n, st.st_size - n);
+		assert(r > 0);
+		n += r;
+	}
+	buf[n] = '\0';
+	return buf;
+}
+
+struct input_split *test_inputify(void *p)
+{
+	struct input_split *root = NULL;
+
+	for (int i = SPLITS - 1; i >= 0; i--) {
+		struct input_split *n = malloc(sizeof(struct input_split));
+		n->key = i;
+		n->value = strdup(words[i % 4]);
+		n->next = root;
+		root = n;
+	}
+	return root;
+}
+
+int wc_map(struct input_split *input, struct wc_table *t)
+{
+	for (; input; input = input->next) {
+		if (wc_emit(t, input->value, 1) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+int wc_output(struct wc_entry *entries, size_t size)
+{
+	assert(size == 4);
+	for (int i = 0; i < size; i++) {
+		assert(strcmp(entries[i].key, words[i]) == 0);
+		assert(entries[i].value == SPLITS / 4);
+	}
+	return 0;
+}
+
+int mx_map(struct input_split *input, struct mx_table *t)
+{
+	for (; input; input = input->next) {
+		if (mx_emit(t, input->key % 7, input->key) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+int mx_output(struct mx_entry *entries, size_t size)
+{
+	assert(size == 7);
+	for (int i = 0; i < size; i++) {
+		assert(entries[i].key == i);
+		// Biggest split key congruent to i modulo 7.
+		assert(entries[i].value == SPLITS - 1 - (SPLITS - 1 - i) % 7);
+	}
+	return 0;
+}
+
+// Fails on the splits of a single task.
+int mx_map_error(struct input_split *input, struct mx_table *t)
+{
+	if (input && input->key % 2)
+		return 1;
+	return mx_map(input, t);
+}
+
+int main()
+{
+	struct wc_operations wc_op = {
+		test_inputify,
+		wc_map,
+		wc_output,
+	};
+	struct mx_operations mx_op = {
+		test_inputify,
+		mx_map,
+		mx_output,
+	};
+
+	for (int threads = 1; threads <= 3; threads++) {
+		assert(wc_operate(&wc_op, NULL, threads) == 0);
+		assert(mx_operate(&mx_op, NULL, threads) == 0);
+	}
+
+	// Any other value than 0 returned by the map is a failure.
+	mx_op.map = mx_map_error;
+	assert(mx_operate(&mx_op, NULL, 2) == -1);
+
+	// Sorting sorted, reversed, pseudo-random and constant keys,
+	// also through the heapsort fallback.
+	static struct mx_entry e[SORTED];
+	for (int kind = 0; kind < 4; kind++) {
+		for (int heap = 0; heap < 2; heap++) {
+			uint64_t x = 42;
+			for (int i = 0; i < SORTED; i++) {
+				x = x * 6364136223846793005ULL + 1;
+				e[i].key = kind == 0 ? i :
+				    kind == 1 ? SORTED - i :
+				    kind == 2 ? x >> 40 : 7;
+			}
+			if (heap)
+				mx_heap_sort(e, SORTED);
+			else
+				mx_sort(e, SORTED);
+			for (int i = 1; i < SORTED; i++)
+				assert(e[i - 1].key <= e[i].key);
+		}
+	}
+
+	char trace[] = "/tmp/mr-trace-XXXXXX";
+	int fd = mkstemp(trace);
+	assert(fd != -1);
+	assert(setenv(TRACE_ENV, trace, 1) == 0);
+	assert(wc_operate(&wc_op, NULL, 2) == 0);
+	assert(unsetenv(TRACE_ENV) == 0);
+	char *buf = read_file(fd);
+	assert(strstr(buf, "\"name\":\"map\""));
+	assert(strstr(buf, "\"name\":\"merge\""));
+	assert(strstr(buf, "\"name\":\"reduce\""));
+	free(buf);
+	close(fd);
+	unlink(trace);
+
+	return 0;
+}